@@ -2,6 +2,10 @@
 #define _compression_h
 #include <iomanip>
 #include <thread>
+#include <cstring> // memcpy
+#include <cmath> // log2
+#include <climits> // LLONG_MAX
+#include <intrin.h> // __cpuid, BMI2 intrinsics
 #include "lib/PriorityQueue.h"
 
 
@@ -93,6 +97,20 @@ static inline u32 readFourBytes(u8* inBuffer, s64 & byte_pos, u8 bit_pos)
 	return bytes;
 }
 
+// writes lowest count bits of value to a outBuffer, lowest bit first
+static inline void writeBits(u32 value, u8 count, u8* outBuffer, s64 & byte_pos, u8 & bit_pos)
+{
+	for (u8 i = 0; i < count; ++i) writeBit((value & (1 << i)) != 0, outBuffer, byte_pos, bit_pos);
+}
+
+// returns next count bits from given inBuffer, first read bit being the lowest one
+static inline u32 readBits(u8 count, u8* inBuffer, s64 & byte_pos, u8 & bit_pos)
+{
+	u32 value = 0;
+	for (u8 i = 0; i < count; ++i) value |= (u32)readBit(inBuffer, byte_pos, bit_pos) << i;
+	return value;
+}
+
 
 
 
@@ -323,18 +341,472 @@ static void printProgressBar(statistics stats, bool compressing)
 	std::cout.flush();
 }
 
+// with metrics coding is done in blocks of this many uncompressed bytes, keeping a compression ratio per block
+// otherwise whole buffer is coded by a single kernel call
+#ifdef COMPRESSION_METRICS
+const s64 CODING_BLOCK_SIZE = 1 << 20;
+#else
+const s64 CODING_BLOCK_SIZE = LLONG_MAX;
+#endif
+
+enum metricsPhase { PHASE_READ, PHASE_HISTOGRAM, PHASE_TREE_BUILD, PHASE_TABLE_BUILD, PHASE_CODING, PHASE_ENCRYPT, PHASE_WRITE, PHASE_COUNT };
+
+// runtime metrics of compression/decompression, collected only if COMPRESSION_METRICS is defined
+// otherwise METRICS_* macros expand to nothing
+#ifdef COMPRESSION_METRICS
+#include <chrono>
+#include <vector>
+
+static const char* MetricsPhaseNames[PHASE_COUNT] = { "read", "histogram", "tree_build", "table_build", "coding", "encrypt", "write" };
+
+struct metrics
+{
+	double phase_seconds[PHASE_COUNT] = {};
+	std::chrono::steady_clock::time_point phase_start[PHASE_COUNT];
+	s64 block_start_bits = 0;
+
+	s64 bytes_in = 0;
+	s64 bytes_out = 0;
+	s64 symbols = 0;
+	// bits of encoded symbols, header not included
+	s64 code_bits = 0;
+	// compressed size / uncompressed size for each CODING_BLOCK_SIZE block
+	std::vector<float> block_ratios;
+
+	double averageCodeLength() const { return symbols > 0 ? (double)code_bits / symbols : 0.0; }
+};
+
+static metrics Metrics;
+
+static inline const metrics & getMetrics() { return Metrics; }
+static inline void resetMetrics() { Metrics = metrics(); }
+
+static inline void metricsBegin(metricsPhase phase) { Metrics.phase_start[phase] = std::chrono::steady_clock::now(); }
+static inline void metricsEnd(metricsPhase phase)
+{
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - Metrics.phase_start[phase];
+	Metrics.phase_seconds[phase] += elapsed.count();
+}
+
+// position is in bits of compressed stream, block ends after given uncompressed_bytes
+static inline void metricsBlockBegin(s64 position) { Metrics.block_start_bits = position; }
+static inline void metricsBlockEnd(s64 uncompressed_bytes, s64 position)
+{
+	s64 compressed_bits = position - Metrics.block_start_bits;
+	Metrics.code_bits += compressed_bits;
+	if (uncompressed_bytes > 0) Metrics.block_ratios.push_back((float)(compressed_bits / 8.0 / uncompressed_bytes));
+}
+
+// writes metrics as a single JSON object
+static void writeMetricsJSON(std::ostream & out, const metrics & m = Metrics)
+{
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+
+	out << "{\"phase_seconds\": {";
+	for (s32 phase = 0; phase < PHASE_COUNT; ++phase)
+		out << (phase ? ", " : "") << "\"" << MetricsPhaseNames[phase] << "\": " << std::fixed << std::setprecision(6) << m.phase_seconds[phase];
+	out << "}, \"bytes_in\": " << m.bytes_in << ", \"bytes_out\": " << m.bytes_out << ", \"symbols\": " << m.symbols;
+	out << ", \"code_bits\": " << m.code_bits << ", \"average_code_length\": " << std::setprecision(4) << m.averageCodeLength();
+	out << ", \"block_size\": " << CODING_BLOCK_SIZE << ", \"block_ratios\": [";
+	for (std::size_t i = 0; i < m.block_ratios.size(); ++i)
+		out << (i ? ", " : "") << m.block_ratios[i];
+	out << "]}\n";
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+#define METRICS_BEGIN(phase) metricsBegin(phase)
+#define METRICS_END(phase) metricsEnd(phase)
+#define METRICS_ADD(field, value) (Metrics.field += (value))
+#define METRICS_BLOCK_BEGIN(position) metricsBlockBegin(position)
+#define METRICS_BLOCK_END(uncompressed_bytes, position) metricsBlockEnd(uncompressed_bytes, position)
+#else
+#define METRICS_BEGIN(phase)
+#define METRICS_END(phase)
+#define METRICS_ADD(field, value)
+#define METRICS_BLOCK_BEGIN(position)
+#define METRICS_BLOCK_END(uncompressed_bytes, position)
+#endif
+
+// cpu features which encoding/decoding kernels are specialized on
+struct cpuFeatures
+{
+	bool bmi2 = false; // shlx/shrx/bzhi bit extraction
+};
+
+static cpuFeatures detectCpuFeatures()
+{
+	cpuFeatures features;
+	int info[4] = {};
+	__cpuid(info, 0);
+	if (info[0] >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		features.bmi2 = (info[1] & (1 << 8)) != 0;
+	}
+	return features;
+}
+
+// checked once at startup, so that the fastest kernel variant is picked on every machine
+static const cpuFeatures CpuFeatures = detectCpuFeatures();
+
+
+// bit buffer operations, kernels are instantiated once per implementation
+// count must always be less than 64
+struct bitOpsGeneric
+{
+	static inline u64 shiftLeft(u64 value, u32 count) { return value << count; }
+	static inline u64 shiftRight(u64 value, u32 count) { return value >> count; }
+	static inline u64 lowBits(u64 value, u32 count) { return value & (((u64)1 << count) - 1); }
+};
+
+struct bitOpsBMI2
+{
+	static inline u64 shiftLeft(u64 value, u32 count) { return _shlx_u64(value, count); }
+	static inline u64 shiftRight(u64 value, u32 count) { return _shrx_u64(value, count); }
+	static inline u64 lowBits(u64 value, u32 count) { return _bzhi_u64(value, count); }
+};
+
+
+// codeword packed to a single u64 so it can be written to a bit buffer in one go
+struct packedCode
+{
+	u64 bits = 0;
+	u32 length = 0;
+};
+
+// converts symbol table to packed codes and returns the longest codeword length
+static u32 buildPackedCodes(codeword st[256], packedCode packed[256])
+{
+	u32 max_code_bits = 0;
+	for (s32 s = 0; s < 256; ++s)
+	{
+		if (st[s].limit > max_code_bits) max_code_bits = st[s].limit;
+
+		packed[s] = packedCode();
+		// such codes are only used by encodeGeneric
+		if (st[s].limit == 0 || st[s].limit >= 64) continue;
+
+		u64 bits = 0;
+		memcpy(&bits, st[s].code, 8);
+		// code[] can contain leftover bits after limit from other branches of the tree
+		packed[s].bits = bits & (((u64)1 << st[s].limit) - 1);
+		packed[s].length = st[s].limit;
+	}
+	return max_code_bits;
+}
+
+// writes whole bytes from bit_buffer to outBuffer, leaves upto 7 bits in bit_buffer
+template <typename BITS>
+static inline void flushBits(u64 & bit_buffer, u32 & bit_count, u8* outBuffer, s64 outBuffer_size, s64 & byte_pos_out)
+{
+	u32 byte_count = bit_count >> 3;
+	// partial byte is written too, it will be overwritten by the next flush
+	if (byte_pos_out + 8 <= outBuffer_size) memcpy(outBuffer + byte_pos_out, &bit_buffer, 8);
+	else for (u32 i = 0; i < byte_count; ++i) outBuffer[byte_pos_out + i] = (u8)(bit_buffer >> (8 * i));
+
+	byte_pos_out += byte_count;
+	bit_buffer = BITS::shiftRight(bit_buffer, byte_count * 8);
+	bit_count &= 7;
+}
+
+// picks a code of a symbol from a single table, previous byte is not used
+struct orderZeroEncoder
+{
+	typedef const packedCode* table;
+	static inline packedCode code(table codes, u8 /* previous */, u8 symbol) { return codes[symbol]; }
+};
+
+// encodes inBuffer from byte_pos_in upto inBuffer_end, codes can't be longer than MAX_CODE_BITS
+// ENCODER picks a code of every symbol from the table, it may depend on the previous byte
+// byte_pos_out and bit_pos_out must point where encoding should continue
+template <u32 MAX_CODE_BITS, typename BITS, typename ENCODER = orderZeroEncoder>
+static void encodeKernel(const u8* inBuffer, s64 inBuffer_end, typename ENCODER::table table,
+						 u8* outBuffer, s64 outBuffer_size, s64 & byte_pos_in, s64 & byte_pos_out, u8 & bit_pos_out)
+{
+	// after a flush upto 7 bits stay in bit_buffer, so this many codes always fit before next flush
+	const s64 codes_per_flush = 56 / MAX_CODE_BITS;
+
+	u64 bit_buffer = outBuffer[byte_pos_out] & ((1 << bit_pos_out) - 1);
+	u32 bit_count = bit_pos_out;
+	s64 pos = byte_pos_in;
+	u8 previous = pos > 0 ? inBuffer[pos - 1] : 0;
+
+	while (pos + codes_per_flush <= inBuffer_end)
+	{
+		for (s64 i = 0; i < codes_per_flush; ++i)
+		{
+			u8 symbol = inBuffer[pos++];
+			packedCode code = ENCODER::code(table, previous, symbol);
+			bit_buffer |= BITS::shiftLeft(code.bits, bit_count);
+			bit_count += code.length;
+			previous = symbol;
+		}
+		flushBits<BITS>(bit_buffer, bit_count, outBuffer, outBuffer_size, byte_pos_out);
+		byte_pos_in = pos;
+	}
+	while (pos < inBuffer_end)
+	{
+		u8 symbol = inBuffer[pos++];
+		packedCode code = ENCODER::code(table, previous, symbol);
+		bit_buffer |= BITS::shiftLeft(code.bits, bit_count);
+		bit_count += code.length;
+		previous = symbol;
+		flushBits<BITS>(bit_buffer, bit_count, outBuffer, outBuffer_size, byte_pos_out);
+	}
+	// remaining bits of the last byte
+	if (bit_count > 0) outBuffer[byte_pos_out] = (u8)bit_buffer;
+	bit_pos_out = (u8)bit_count;
+	byte_pos_in = pos;
+}
+
+// fallback for codes which don't fit any specialized kernel, writes codes bit by bit
+static void encodeGeneric(const u8* inBuffer, s64 inBuffer_end, codeword st[256],
+						  u8* outBuffer, s64 & byte_pos_in, s64 & byte_pos_out, u8 & bit_pos_out)
+{
+	while (byte_pos_in < inBuffer_end)
+	{
+		const codeword & code = st[inBuffer[byte_pos_in++]];
+		for (u8 i = 0; i < code.limit; ++i)
+			writeBit((code.code[i / 8] & (1 << (i % 8))) != 0, outBuffer, byte_pos_out, bit_pos_out);
+	}
+}
+
+typedef void (*encodeKernelFn)(const u8*, s64, const packedCode*, u8*, s64, s64 &, s64 &, u8 &);
+
+// picks the kernel for the smallest code length limit covering max_code_bits
+// returns nullptr if codes are too long for any of them
+template <typename BITS>
+static encodeKernelFn encodeKernelFor(u32 max_code_bits)
+{
+	if (max_code_bits <= 14) return encodeKernel<14, BITS>;
+	if (max_code_bits <= 18) return encodeKernel<18, BITS>;
+	if (max_code_bits <= 28) return encodeKernel<28, BITS>;
+	if (max_code_bits <= 56) return encodeKernel<56, BITS>;
+	return nullptr;
+}
+
+static encodeKernelFn selectEncodeKernel(u32 max_code_bits)
+{
+	if (CpuFeatures.bmi2) return encodeKernelFor<bitOpsBMI2>(max_code_bits);
+	return encodeKernelFor<bitOpsGeneric>(max_code_bits);
+}
+
+
+struct decodeEntry
+{
+	// symbol if entry resolves a whole codeword, otherwise
+	// HuffmanArray position from which decoding continues bit by bit
+	u16 value;
+	// bits consumed by this entry
+	u8 length;
+	u8 leaf;
+};
+
+// fills decode table from HuffmanArray: bits of a stream are indexing it, first bit being the lowest one
+// codes longer than table_bits point to a node in HuffmanArray after table_bits were consumed
+static void buildDecodeTable(decodeEntry* table, u32 table_bits, u16 real_pos = 1, u32 depth = 0, u32 prefix = 0)
+{
+	ArrayNode node = HuffmanArray[real_pos];
+	if (node.isLeaf())
+	{
+		for (u32 high = 0; high < (1u << (table_bits - depth)); ++high)
+			table[prefix | (high << depth)] = decodeEntry{ node.symbol, (u8)depth, 1 };
+		return;
+	}
+	if (depth == table_bits)
+	{
+		table[prefix] = decodeEntry{ real_pos, (u8)depth, 0 };
+		return;
+	}
+	buildDecodeTable(table, table_bits, node.virtual_pos * 2, depth + 1, prefix);
+	buildDecodeTable(table, table_bits, node.virtual_pos * 2 + 1, depth + 1, prefix | (1u << depth));
+}
+
+// returns longest codeword length of a tree stored in HuffmanArray
+static u32 huffmanArrayDepth(u16 real_pos = 1)
+{
+	ArrayNode node = HuffmanArray[real_pos];
+	if (node.isLeaf()) return 0;
+	u32 zero = huffmanArrayDepth(node.virtual_pos * 2);
+	u32 one = huffmanArrayDepth(node.virtual_pos * 2 + 1);
+	return 1 + (zero > one ? zero : one);
+}
+
+// loads bytes to bit_buffer so that it has at least 56 valid bits, past the end of inBuffer zeros are loaded
+template <typename BITS>
+static inline void refillBits(const u8* inBuffer, s64 inBuffer_size, s64 & next_byte, u64 & bit_buffer, u32 & bit_count)
+{
+	if (next_byte + 8 <= inBuffer_size)
+	{
+		u64 bytes;
+		memcpy(&bytes, inBuffer + next_byte, 8);
+		bit_buffer |= BITS::shiftLeft(bytes, bit_count);
+		next_byte += (63 - bit_count) >> 3;
+		bit_count |= 56;
+	}
+	else
+	{
+		while (bit_count <= 56)
+		{
+			u64 byte = next_byte < inBuffer_size ? inBuffer[next_byte] : 0;
+			bit_buffer |= BITS::shiftLeft(byte, bit_count);
+			next_byte += 1;
+			bit_count += 8;
+		}
+	}
+}
+
+template <u32 TABLE_BITS, typename BITS>
+static inline u8 decodeSymbol(const decodeEntry* table, u64 & bit_buffer, u32 & bit_count)
+{
+	decodeEntry entry = table[BITS::lowBits(bit_buffer, TABLE_BITS)];
+	bit_buffer = BITS::shiftRight(bit_buffer, entry.length);
+	bit_count -= entry.length;
+	if (entry.leaf) return (u8)entry.value;
+
+	u16 real_pos = entry.value;
+	while (!HuffmanArray[real_pos].isLeaf())
+	{
+		u16 bit = (u16)(bit_buffer & 1);
+		bit_buffer >>= 1;
+		bit_count -= 1;
+		real_pos = HuffmanArray[real_pos].virtual_pos * 2 + bit;
+	}
+	return HuffmanArray[real_pos].symbol;
+}
+
+// decodes a symbol with a single table of TABLE_BITS, previous byte is not used
+template <u32 TABLE_BITS>
+struct orderZeroDecoder
+{
+	typedef const decodeEntry* table;
+	template <typename BITS>
+	static inline u8 decode(table entries, u8 /* previous */, u64 & bit_buffer, u32 & bit_count)
+	{
+		return decodeSymbol<TABLE_BITS, BITS>(entries, bit_buffer, bit_count);
+	}
+};
+
+// decodes symbols from inBuffer to outBuffer upto outBuffer_end, codes can't be longer than MAX_CODE_BITS
+// DECODER resolves every symbol with the table, it may depend on the previous decoded byte
+// byte_pos_in and bit_pos_in must point where decoding should continue, they point after last decoded code when done
+template <u32 MAX_CODE_BITS, typename BITS, typename DECODER>
+static void decodeKernel(const u8* inBuffer, s64 inBuffer_size, typename DECODER::table table,
+						 u8* outBuffer, s64 outBuffer_end, s64 & byte_pos_in, u8 & bit_pos_in, s64 & byte_pos_out)
+{
+	// refill leaves at least 56 bits in bit_buffer, so this many codes can be decoded per refill
+	const s64 codes_per_refill = 56 / MAX_CODE_BITS;
+
+	u64 bit_buffer = 0;
+	u32 bit_count = 0;
+	s64 next_byte = byte_pos_in;
+	refillBits<BITS>(inBuffer, inBuffer_size, next_byte, bit_buffer, bit_count);
+	bit_buffer >>= bit_pos_in;
+	bit_count -= bit_pos_in;
+
+	s64 pos = byte_pos_out;
+	u8 previous = pos > 0 ? outBuffer[pos - 1] : 0;
+	while (pos + codes_per_refill <= outBuffer_end)
+	{
+		refillBits<BITS>(inBuffer, inBuffer_size, next_byte, bit_buffer, bit_count);
+		for (s64 i = 0; i < codes_per_refill; ++i)
+		{
+			previous = DECODER::template decode<BITS>(table, previous, bit_buffer, bit_count);
+			outBuffer[pos++] = previous;
+		}
+		byte_pos_out = pos;
+		byte_pos_in = next_byte - (bit_count >> 3);
+	}
+	while (pos < outBuffer_end)
+	{
+		refillBits<BITS>(inBuffer, inBuffer_size, next_byte, bit_buffer, bit_count);
+		previous = DECODER::template decode<BITS>(table, previous, bit_buffer, bit_count);
+		outBuffer[pos++] = previous;
+	}
+	byte_pos_out = pos;
+
+	// exact position after last decoded code
+	s64 consumed_bits = next_byte * 8 - bit_count;
+	byte_pos_in = consumed_bits / 8;
+	bit_pos_in = (u8)(consumed_bits % 8);
+}
+
+// fallback for codes which don't fit any specialized kernel, walks HuffmanArray bit by bit
+static void decodeGeneric(const u8* inBuffer, u8* outBuffer, s64 outBuffer_end, s64 & byte_pos_in, u8 & bit_pos_in, s64 & byte_pos_out)
+{
+	u8 byte = inBuffer[byte_pos_in];
+	while (byte_pos_out < outBuffer_end)
+	{
+		u16 real_pos = 1;
+		while (!HuffmanArray[real_pos].isLeaf())
+		{
+			// getBit
+			bool bit = (byte & (1 << bit_pos_in)) != 0;
+			bit_pos_in += 1;
+			if (bit_pos_in == 8)
+			{
+				bit_pos_in = 0;
+				byte = inBuffer[++byte_pos_in];
+			}
+
+			if (bit) real_pos = HuffmanArray[real_pos].virtual_pos * 2 + 1;
+			else	 real_pos = HuffmanArray[real_pos].virtual_pos * 2;
+		}
+		// writeByte
+		outBuffer[byte_pos_out++] = HuffmanArray[real_pos].symbol;
+	}
+}
+
+// smaller table for short codes, otherwise most codes are resolved by a single lookup
+static inline u32 decodeTableBits(u32 max_code_bits) { return max_code_bits <= 8 ? 8 : 11; }
+static decodeEntry DecodeTable[1 << 11];
+
+typedef void (*decodeKernelFn)(const u8*, s64, const decodeEntry*, u8*, s64, s64 &, u8 &, s64 &);
+
+// picks the kernel for the smallest code length limit covering max_code_bits
+// returns nullptr if codes are too long for any of them
+template <typename BITS>
+static decodeKernelFn decodeKernelFor(u32 max_code_bits)
+{
+	if (max_code_bits <= 8)  return decodeKernel<14, BITS, orderZeroDecoder<8> >;
+	if (max_code_bits <= 14) return decodeKernel<14, BITS, orderZeroDecoder<11> >;
+	if (max_code_bits <= 18) return decodeKernel<18, BITS, orderZeroDecoder<11> >;
+	if (max_code_bits <= 28) return decodeKernel<28, BITS, orderZeroDecoder<11> >;
+	if (max_code_bits <= 56) return decodeKernel<56, BITS, orderZeroDecoder<11> >;
+	return nullptr;
+}
+
+static decodeKernelFn selectDecodeKernel(u32 max_code_bits)
+{
+	if (CpuFeatures.bmi2) return decodeKernelFor<bitOpsBMI2>(max_code_bits);
+	return decodeKernelFor<bitOpsGeneric>(max_code_bits);
+}
+
+
 // compresses file from inBuffer to outBuffer and returns size of compressed size in bytes
 s64 compress(u8* inBuffer, const s64 inBuffer_size, u8* outBuffer, s64 outBuffer_size, filenames files)
 {
+	METRICS_BEGIN(PHASE_HISTOGRAM);
 	s32 freqTable[256] = {};
 	buildFrequencyTable(inBuffer, inBuffer_size, freqTable);
+	METRICS_END(PHASE_HISTOGRAM);
 
+	METRICS_BEGIN(PHASE_TREE_BUILD);
 	HuffmanNode* root = buildHuffmanTree(freqTable);
+	METRICS_END(PHASE_TREE_BUILD);
 
+	METRICS_BEGIN(PHASE_TABLE_BUILD);
 	codeword st[256]; // symbol table maping symbols to codewords
 	u8 temp_code[32] = {};
 	buildEncodingMap(root, st, temp_code, 0);
 
+	packedCode packed[256];
+	u32 max_code_bits = buildPackedCodes(st, packed);
+	encodeKernelFn encode = selectEncodeKernel(max_code_bits);
+
 	s64 byte_pos_out = 0;
 	u8 bit_pos_out = 0;
 	// write a tree in order for a decoder to be able to expand
@@ -346,6 +818,7 @@ s64 compress(u8* inBuffer, const s64 inBuffer_size, u8* outBuffer, s64 outBuffer
 	// write ammount of symbols overall in a file
 	// so decoder will know when to stop reading
 	writeFourBytes((u32)inBuffer_size, outBuffer, byte_pos_out, bit_pos_out);
+	METRICS_END(PHASE_TABLE_BUILD);
 
 
 	s64 byte_pos_in = 0;
@@ -353,77 +826,558 @@ s64 compress(u8* inBuffer, const s64 inBuffer_size, u8* outBuffer, s64 outBuffer
 	std::thread stats_thread(printProgressBar, statistics {&byte_pos_in, &byte_pos_out,
 							inBuffer_size, files}, true /* compressing */);
 
+	METRICS_BEGIN(PHASE_CODING);
 	// use symbol table maping to encode a file
-	for (s64 i = 0; i < inBuffer_size; ++i)
+	while (byte_pos_in < inBuffer_size)
 	{
-		// readByte
-		codeword code = st[inBuffer[byte_pos_in++]];
-
-		const u8 code_byte_count = code.limit / 8;
-		for (u8 code_byte_pos = 0; code_byte_pos < code_byte_count; ++code_byte_pos)
-		{
-			// fill the remaining of byte and overwrite the last byte in a outBuffer with it
-			outBuffer[byte_pos_out++] |= ((code.code[code_byte_pos] & ((1 << (8 - bit_pos_out)) - 1)) << bit_pos_out);
-			// put the rest of bits to a new byte
-			outBuffer[byte_pos_out] = (code.code[code_byte_pos] >> ((8 - bit_pos_out) % 8));
-		}
+		const s64 block_start = byte_pos_in;
+		const s64 block_end = inBuffer_size - block_start > CODING_BLOCK_SIZE ? block_start + CODING_BLOCK_SIZE : inBuffer_size;
+		METRICS_BLOCK_BEGIN(byte_pos_out * 8 + bit_pos_out);
 
-		//u8 byte = outBuffer[byte_pos_out];
-		const u8 code_bit_remainder = code.limit % 8;
-		for (u8 code_bit_pos = 0; code_bit_pos < code_bit_remainder; ++code_bit_pos)
-		{
-			// writeBit
-			bool bit = (code.code[code_byte_count] & (1 << code_bit_pos)) != 0;
-			outBuffer[byte_pos_out] |= (bit << bit_pos_out);
+		if (encode) encode(inBuffer, block_end, packed, outBuffer, outBuffer_size, byte_pos_in, byte_pos_out, bit_pos_out);
+		else		encodeGeneric(inBuffer, block_end, st, outBuffer, byte_pos_in, byte_pos_out, bit_pos_out);
 
-			bit_pos_out = (bit_pos_out + 1) % 8;
-			byte_pos_out += (bit_pos_out != 0);
-		}
+		METRICS_BLOCK_END(block_end - block_start, byte_pos_out * 8 + bit_pos_out);
 	}
+	METRICS_END(PHASE_CODING);
+
 	stats_thread.join();
-	return (bit_pos_out == 0 ? byte_pos_out : byte_pos_out + 1);
+	const s64 compressed_size = (bit_pos_out == 0 ? byte_pos_out : byte_pos_out + 1);
+
+	METRICS_ADD(bytes_in, inBuffer_size);
+	METRICS_ADD(bytes_out, compressed_size);
+	METRICS_ADD(symbols, inBuffer_size);
+	return compressed_size;
 }
 
 // decompress file from inBuffer to outBuffer and returns size of decompressed size in bytes
 s64 decompress(u8* inBuffer, s64 inBuffer_size, u8* outBuffer, s64 outBuffer_size, filenames files)
 {
+	METRICS_BEGIN(PHASE_TREE_BUILD);
 	s64 byte_pos_in = 0;
 	u8 bit_pos_in = 0;
 	// extract huffman tree from an encoded stream
 	HuffmanNode* root = readHuffmanTree(inBuffer, byte_pos_in, bit_pos_in);
 	transferHuffmanTreeToArray(root);
+	clearTree(root);
 	// get how many symbols are in an encoded stream
 	u32 size = readFourBytes(inBuffer, byte_pos_in, bit_pos_in);
+	METRICS_END(PHASE_TREE_BUILD);
+
+	METRICS_BEGIN(PHASE_TABLE_BUILD);
+	u32 max_code_bits = huffmanArrayDepth();
+	decodeKernelFn decode = selectDecodeKernel(max_code_bits);
+	if (decode) buildDecodeTable(DecodeTable, decodeTableBits(max_code_bits));
+	METRICS_END(PHASE_TABLE_BUILD);
 
 	s64 byte_pos_out = 0;
 	// create a thread to print progress bar
 	std::thread stats_thread(printProgressBar, statistics{&byte_pos_in, &byte_pos_out,
 							inBuffer_size, files}, false /* compressing */);
+
+	METRICS_BEGIN(PHASE_CODING);
 	// decode encoded stream
-	u8 byte = inBuffer[byte_pos_in];
-	for (u32 pos = 0; pos < size; ++pos)
+	while (byte_pos_out < size)
 	{
-		u16 real_pos = 1;
-		while (!HuffmanArray[real_pos].isLeaf())
+		const s64 block_start = byte_pos_out;
+		const s64 block_end = size - block_start > CODING_BLOCK_SIZE ? block_start + CODING_BLOCK_SIZE : size;
+		METRICS_BLOCK_BEGIN(byte_pos_in * 8 + bit_pos_in);
+
+		if (decode) decode(inBuffer, inBuffer_size, DecodeTable, outBuffer, block_end, byte_pos_in, bit_pos_in, byte_pos_out);
+		else		decodeGeneric(inBuffer, outBuffer, block_end, byte_pos_in, bit_pos_in, byte_pos_out);
+
+		METRICS_BLOCK_END(block_end - block_start, byte_pos_in * 8 + bit_pos_in);
+	}
+	METRICS_END(PHASE_CODING);
+
+	stats_thread.join();
+
+	METRICS_ADD(bytes_in, inBuffer_size);
+	METRICS_ADD(bytes_out, byte_pos_out);
+	METRICS_ADD(symbols, byte_pos_out);
+	return byte_pos_out;
+}
+
+
+// order-1 context mode: every symbol is coded with a code chosen by the previous byte
+// previous byte contexts are grouped to clusters of similar distributions, each cluster has its own
+// length limited canonical code, so a whole codeword is always decoded by a single table lookup
+const u32 CONTEXT_MAX_CLUSTERS = 16;
+const u32 CONTEXT_MAX_CODE_BITS = 11;
+
+// upper bound of header size of both modes, outBuffer should have this much space on top of input size
+const s64 MAX_HEADER_SIZE = 4096;
+
+// freqTable size should be 256 * 256 -> freq of each byte after each previous byte, first byte follows zero
+static void buildContextFrequencyTable(u8* inBuffer, s64 inBuffer_size, s32* freqTable)
+{
+	memset(freqTable, 0, 256 * 256 * sizeof(s32));
+	u8 previous = 0;
+	for (s64 i = 0; i < inBuffer_size; ++i)
+	{
+		freqTable[previous * 256 + inBuffer[i]] += 1;
+		previous = inBuffer[i];
+	}
+}
+
+// stores depth of each leaf to lengths and returns the deepest one
+static u32 assignCodeLengths(HuffmanNode* tree, u8 lengths[256], u32 depth = 0)
+{
+	if (tree->isLeaf())
+	{
+		lengths[tree->symbol] = (u8)depth;
+		return depth;
+	}
+	u32 zero = assignCodeLengths(tree->zero, lengths, depth + 1);
+	u32 one = assignCodeLengths(tree->one, lengths, depth + 1);
+	return zero > one ? zero : one;
+}
+
+// code lengths of a huffman tree no deeper than max_code_bits
+// while the tree is too deep frequencies are flattened and the tree is rebuilt
+static void buildLengthLimitedCodeLengths(const s32* freqTable, u8 lengths[256], u32 max_code_bits)
+{
+	s32 freq[256];
+	bool empty = true;
+	for (s32 s = 0; s < 256; ++s)
+	{
+		freq[s] = freqTable[s];
+		lengths[s] = 0;
+		if (freq[s] > 0) empty = false;
+	}
+	if (empty) return;
+
+	for (;;)
+	{
+		HuffmanNode* root = buildHuffmanTree(freq);
+		for (s32 s = 0; s < 256; ++s) lengths[s] = 0;
+		u32 depth = assignCodeLengths(root, lengths);
+		clearTree(root);
+		if (depth <= max_code_bits) return;
+
+		for (s32 s = 0; s < 256; ++s)
+			if (freq[s] > 0) freq[s] = 1 + freq[s] / 2;
+	}
+}
+
+// assigns canonical codes from code lengths
+// codes are bit reversed, since streams are read starting from the lowest bit
+static void buildCanonicalCodes(const u8 lengths[256], packedCode codes[256])
+{
+	u32 length_count[CONTEXT_MAX_CODE_BITS + 1] = {};
+	for (s32 s = 0; s < 256; ++s)
+		if (lengths[s] > 0) length_count[lengths[s]] += 1;
+
+	u32 next_code[CONTEXT_MAX_CODE_BITS + 1] = {};
+	u32 code = 0;
+	for (u32 length = 1; length <= CONTEXT_MAX_CODE_BITS; ++length)
+	{
+		code = (code + length_count[length - 1]) << 1;
+		next_code[length] = code;
+	}
+
+	for (s32 s = 0; s < 256; ++s)
+	{
+		codes[s] = packedCode();
+		if (lengths[s] == 0) continue;
+
+		u32 canonical = next_code[lengths[s]]++;
+		for (u32 i = 0; i < lengths[s]; ++i)
+			codes[s].bits |= (u64)((canonical >> i) & 1) << (lengths[s] - 1 - i);
+		codes[s].length = lengths[s];
+	}
+}
+
+// every entry holds symbol in the low byte and code length in the high byte
+static void buildContextDecodeTable(const packedCode codes[256], u16* table)
+{
+	for (s32 s = 0; s < 256; ++s)
+	{
+		if (codes[s].length == 0) continue;
+		for (u32 high = 0; high < (1u << (CONTEXT_MAX_CODE_BITS - codes[s].length)); ++high)
+			table[codes[s].bits | (high << codes[s].length)] = (u16)(s | (codes[s].length << 8));
+	}
+}
+
+// bits needed to store a cluster index
+static inline u8 clusterIndexBits(u32 cluster_count)
+{
+	u8 bits = 0;
+	while ((1u << bits) < cluster_count) ++bits;
+	return bits;
+}
+
+// size in bits of the whole context stream: header and encoded symbols, symbol count not included
+static s64 contextStreamBits(const s32* freqTable, const u8 clusterOf[256], u32 cluster_count, u8 lengths[][256])
+{
+	s64 bits = 8 + (cluster_count > 1 ? 256 * clusterIndexBits(cluster_count) : 0);
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+		for (s32 s = 0; s < 256; ++s)
+			bits += (lengths[cluster][s] > 0 ? 5 : 1);
+
+	for (s32 context = 0; context < 256; ++context)
+		for (s32 s = 0; s < 256; ++s)
+			bits += (s64)freqTable[context * 256 + s] * lengths[clusterOf[context]][s];
+	return bits;
+}
+
+// bits of a stream compressed by compress: tree written by writeHuffmanTree and every symbol coded with it
+// (symbol count is written in both modes, so it is not included)
+static s64 orderZeroStreamBits(const s32* freqTable)
+{
+	s32 freq[256] = {};
+	for (s32 context = 0; context < 256; ++context)
+		for (s32 s = 0; s < 256; ++s)
+			freq[s] += freqTable[context * 256 + s];
+
+	HuffmanNode* root = buildHuffmanTree(freq);
+	u8 lengths[256] = {};
+	assignCodeLengths(root, lengths);
+	clearTree(root);
+
+	// every leaf takes a bit and a symbol, every internal node a bit
+	s64 leaves = 0;
+	s64 bits = 0;
+	for (s32 s = 0; s < 256; ++s)
+	{
+		if (lengths[s] > 0) leaves += 1;
+		bits += (s64)freq[s] * lengths[s];
+	}
+	return bits + leaves * 9 + leaves - 1;
+}
+
+// sums context freqs of every cluster and builds its code lengths
+static void buildClusterCodeLengths(const s32* freqTable, const u8 clusterOf[256], u32 cluster_count, u8 lengths[][256])
+{
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+	{
+		s32 clusterFreq[256] = {};
+		for (s32 context = 0; context < 256; ++context)
+			if (clusterOf[context] == cluster)
+				for (s32 s = 0; s < 256; ++s) clusterFreq[s] += freqTable[context * 256 + s];
+		buildLengthLimitedCodeLengths(clusterFreq, lengths[cluster], CONTEXT_MAX_CODE_BITS);
+	}
+}
+
+// estimated cost in bits of every symbol in every cluster, from summed freqs of cluster's contexts
+static void buildClusterSymbolCosts(const s32* freqTable, const u8 assignment[256], u32 cluster_count,
+									double symbolCost[][256])
+{
+	s64 clusterFreq[CONTEXT_MAX_CLUSTERS][256] = {};
+	for (s32 context = 0; context < 256; ++context)
+		for (s32 s = 0; s < 256; ++s) clusterFreq[assignment[context]][s] += freqTable[context * 256 + s];
+
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+	{
+		s64 total = 0;
+		for (s32 s = 0; s < 256; ++s) total += clusterFreq[cluster][s];
+		// symbols missing from a cluster would get one of the longest codes
+		for (s32 s = 0; s < 256; ++s)
+			symbolCost[cluster][s] = clusterFreq[cluster][s] > 0 ? -log2((double)clusterFreq[cluster][s] / total) : CONTEXT_MAX_CODE_BITS;
+	}
+}
+
+// estimated cost in bits of coding a context with a cluster's code
+static inline double contextCost(const s32* freqTable, s32 context, const double symbolCost[256])
+{
+	double cost = 0;
+	for (s32 s = 0; s < 256; ++s) cost += freqTable[context * 256 + s] * symbolCost[s];
+	return cost;
+}
+
+// groups contexts to clusters with similar symbol distributions, returns cluster count
+// clusters are added one at a time, seeded by the context worst served by current clusters and
+// refined k-means style, cluster count giving the smallest stream (header included) is kept
+static u32 clusterContexts(const s32* freqTable, u8 clusterOf[256], u8 lengths[][256])
+{
+	s64 contextTotal[256] = {};
+	// cost of coding a context with its own distribution
+	double ownCost[256] = {};
+	for (s32 context = 0; context < 256; ++context)
+	{
+		for (s32 s = 0; s < 256; ++s) contextTotal[context] += freqTable[context * 256 + s];
+		for (s32 s = 0; s < 256; ++s)
 		{
-			// getBit
-			bool bit = (byte & (1 << bit_pos_in)) != 0;
-			bit_pos_in += 1;
-			if (bit_pos_in == 8)
+			s32 freq = freqTable[context * 256 + s];
+			if (freq > 0) ownCost[context] -= freq * log2((double)freq / contextTotal[context]);
+		}
+	}
+
+	u8 assignment[256] = {};
+	u32 cluster_count = 1;
+
+	memset(clusterOf, 0, 256);
+	buildClusterCodeLengths(freqTable, clusterOf, 1, lengths);
+	s64 best_bits = contextStreamBits(freqTable, clusterOf, 1, lengths);
+	u32 best_count = 1;
+
+	double symbolCost[CONTEXT_MAX_CLUSTERS][256];
+	// dropping emptied clusters can leave the count unchanged, so the number of seeding rounds is bounded
+	for (u32 round = 1; round < CONTEXT_MAX_CLUSTERS && cluster_count < CONTEXT_MAX_CLUSTERS; ++round)
+	{
+		// seed a new cluster with the context which loses the most bits by sharing a distribution
+		buildClusterSymbolCosts(freqTable, assignment, cluster_count, symbolCost);
+		s32 seed = -1;
+		double worst = 0;
+		for (s32 context = 0; context < 256; ++context)
+		{
+			if (contextTotal[context] == 0) continue;
+			double loss = contextCost(freqTable, context, symbolCost[assignment[context]]) - ownCost[context];
+			if (loss > worst)
 			{
-				bit_pos_in = 0;
-				byte = inBuffer[++byte_pos_in];
+				worst = loss;
+				seed = context;
 			}
+		}
+		if (seed < 0) break;
+		assignment[seed] = (u8)cluster_count++;
 
-			if (bit) real_pos = HuffmanArray[real_pos].virtual_pos * 2 + 1;
-			else	 real_pos = HuffmanArray[real_pos].virtual_pos * 2;
+		// refine: move every context to the cluster which codes it the cheapest
+		for (s32 iteration = 0; iteration < 8; ++iteration)
+		{
+			buildClusterSymbolCosts(freqTable, assignment, cluster_count, symbolCost);
+			bool changed = false;
+			for (s32 context = 0; context < 256; ++context)
+			{
+				if (contextTotal[context] == 0) continue;
+				u8 best_cluster = assignment[context];
+				double best_cost = contextCost(freqTable, context, symbolCost[best_cluster]);
+				for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+				{
+					double cost = contextCost(freqTable, context, symbolCost[cluster]);
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_cluster = (u8)cluster;
+					}
+				}
+				if (best_cluster != assignment[context]) changed = true;
+				assignment[context] = best_cluster;
+			}
+			if (!changed) break;
 		}
-		// writeByte
-		outBuffer[byte_pos_out++] = HuffmanArray[real_pos].symbol;
+
+		// drop clusters which lost all their contexts
+		bool used[CONTEXT_MAX_CLUSTERS] = {};
+		for (s32 context = 0; context < 256; ++context)
+			if (contextTotal[context] > 0) used[assignment[context]] = true;
+		u8 renumber[CONTEXT_MAX_CLUSTERS] = {};
+		u32 used_count = 0;
+		for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+			if (used[cluster]) renumber[cluster] = (u8)used_count++;
+		for (s32 context = 0; context < 256; ++context)
+			assignment[context] = contextTotal[context] > 0 ? renumber[assignment[context]] : 0;
+		cluster_count = used_count > 0 ? used_count : 1;
+
+		// keep assignment if it gives a smaller stream
+		u8 candidateLengths[CONTEXT_MAX_CLUSTERS][256];
+		buildClusterCodeLengths(freqTable, assignment, cluster_count, candidateLengths);
+		s64 bits = contextStreamBits(freqTable, assignment, cluster_count, candidateLengths);
+		if (bits < best_bits)
+		{
+			best_bits = bits;
+			best_count = cluster_count;
+			memcpy(clusterOf, assignment, 256);
+			memcpy(lengths, candidateLengths, sizeof(candidateLengths));
+		}
+	}
+	return best_count;
+}
+
+// packed codes of every cluster
+static packedCode ContextCodes[CONTEXT_MAX_CLUSTERS][256];
+// decode tables of every cluster, indexed by next CONTEXT_MAX_CODE_BITS bits of a stream
+static u16 ContextDecodeTables[CONTEXT_MAX_CLUSTERS][1 << CONTEXT_MAX_CODE_BITS];
+
+// picks a code of a symbol from codes of the previous byte's cluster
+struct contextEncoder
+{
+	typedef const packedCode* const* table;
+	static inline packedCode code(table contextCodes, u8 previous, u8 symbol) { return contextCodes[previous][symbol]; }
+};
+
+// decodes a symbol with a decode table of the previous decoded byte's cluster
+struct contextDecoder
+{
+	typedef const u16* const* table;
+	template <typename BITS>
+	static inline u8 decode(table contextTables, u8 previous, u64 & bit_buffer, u32 & bit_count)
+	{
+		u16 entry = contextTables[previous][BITS::lowBits(bit_buffer, CONTEXT_MAX_CODE_BITS)];
+		u32 length = entry >> 8;
+		bit_buffer = BITS::shiftRight(bit_buffer, length);
+		bit_count -= length;
+		return (u8)entry;
 	}
+};
+
+typedef void (*encodeContextKernelFn)(const u8*, s64, const packedCode* const*, u8*, s64, s64 &, s64 &, u8 &);
+typedef void (*decodeContextKernelFn)(const u8*, s64, const u16* const*, u8*, s64, s64 &, u8 &, s64 &);
+
+static encodeContextKernelFn selectEncodeContextKernel()
+{
+	if (CpuFeatures.bmi2) return encodeKernel<CONTEXT_MAX_CODE_BITS, bitOpsBMI2, contextEncoder>;
+	return encodeKernel<CONTEXT_MAX_CODE_BITS, bitOpsGeneric, contextEncoder>;
+}
+
+static decodeContextKernelFn selectDecodeContextKernel()
+{
+	if (CpuFeatures.bmi2) return decodeKernel<CONTEXT_MAX_CODE_BITS, bitOpsBMI2, contextDecoder>;
+	return decodeKernel<CONTEXT_MAX_CODE_BITS, bitOpsGeneric, contextDecoder>;
+}
+
+// compresses file from inBuffer to outBuffer using order-1 context mode and returns size of compressed size in bytes
+// if compress gives a smaller stream, it is used instead and context_mode is set to false
+s64 compressContext(u8* inBuffer, const s64 inBuffer_size, u8* outBuffer, s64 outBuffer_size, filenames files, bool & context_mode)
+{
+	METRICS_BEGIN(PHASE_HISTOGRAM);
+	s32* freqTable = (s32*)malloc(256 * 256 * sizeof(s32));
+	buildContextFrequencyTable(inBuffer, inBuffer_size, freqTable);
+	METRICS_END(PHASE_HISTOGRAM);
+
+	METRICS_BEGIN(PHASE_TREE_BUILD);
+	u8 clusterOf[256];
+	u8 lengths[CONTEXT_MAX_CLUSTERS][256];
+	u32 cluster_count = clusterContexts(freqTable, clusterOf, lengths);
+	context_mode = inBuffer_size == 0 || contextStreamBits(freqTable, clusterOf, cluster_count, lengths) < orderZeroStreamBits(freqTable);
+	free(freqTable);
+	METRICS_END(PHASE_TREE_BUILD);
+	if (!context_mode) return compress(inBuffer, inBuffer_size, outBuffer, outBuffer_size, files);
+
+	METRICS_BEGIN(PHASE_TABLE_BUILD);
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+		buildCanonicalCodes(lengths[cluster], ContextCodes[cluster]);
+	const packedCode* contextCodes[256];
+	for (s32 context = 0; context < 256; ++context) contextCodes[context] = ContextCodes[clusterOf[context]];
+	encodeContextKernelFn encode = selectEncodeContextKernel();
+
+	s64 byte_pos_out = 0;
+	u8 bit_pos_out = 0;
+	// write clusters and their code lengths in order for a decoder to be able to rebuild the codes
+	writeByte((u8)cluster_count, outBuffer, byte_pos_out, bit_pos_out);
+	if (cluster_count > 1)
+		for (s32 context = 0; context < 256; ++context)
+			writeBits(clusterOf[context], clusterIndexBits(cluster_count), outBuffer, byte_pos_out, bit_pos_out);
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+	{
+		for (s32 s = 0; s < 256; ++s)
+		{
+			// one bit if symbol is present, then 4 bits of its length
+			writeBit(lengths[cluster][s] > 0, outBuffer, byte_pos_out, bit_pos_out);
+			if (lengths[cluster][s] > 0) writeBits(lengths[cluster][s], 4, outBuffer, byte_pos_out, bit_pos_out);
+		}
+	}
+
+	// write ammount of symbols overall in a file
+	// so decoder will know when to stop reading
+	writeFourBytes((u32)inBuffer_size, outBuffer, byte_pos_out, bit_pos_out);
+	METRICS_END(PHASE_TABLE_BUILD);
+
+
+	s64 byte_pos_in = 0;
+	// create a thread to print progress bar
+	std::thread stats_thread(printProgressBar, statistics {&byte_pos_in, &byte_pos_out,
+							inBuffer_size, files}, true /* compressing */);
+
+	METRICS_BEGIN(PHASE_CODING);
+	while (byte_pos_in < inBuffer_size)
+	{
+		const s64 block_start = byte_pos_in;
+		const s64 block_end = inBuffer_size - block_start > CODING_BLOCK_SIZE ? block_start + CODING_BLOCK_SIZE : inBuffer_size;
+		METRICS_BLOCK_BEGIN(byte_pos_out * 8 + bit_pos_out);
+
+		encode(inBuffer, block_end, contextCodes, outBuffer, outBuffer_size, byte_pos_in, byte_pos_out, bit_pos_out);
+
+		METRICS_BLOCK_END(block_end - block_start, byte_pos_out * 8 + bit_pos_out);
+	}
+	METRICS_END(PHASE_CODING);
+
+	stats_thread.join();
+	const s64 compressed_size = (bit_pos_out == 0 ? byte_pos_out : byte_pos_out + 1);
+
+	METRICS_ADD(bytes_in, inBuffer_size);
+	METRICS_ADD(bytes_out, compressed_size);
+	METRICS_ADD(symbols, inBuffer_size);
+	return compressed_size;
+}
+
+// reads clusters and their code lengths written by compressContext, returns false if they are not valid
+static bool readContextHeader(u8* inBuffer, s64 & byte_pos_in, u8 & bit_pos_in, u32 & cluster_count, u8 clusterOf[256], u8 lengths[][256])
+{
+	cluster_count = readByte(inBuffer, byte_pos_in, bit_pos_in);
+	if (cluster_count == 0 || cluster_count > CONTEXT_MAX_CLUSTERS) return false;
+
+	if (cluster_count > 1)
+	{
+		for (s32 context = 0; context < 256; ++context)
+		{
+			clusterOf[context] = (u8)readBits(clusterIndexBits(cluster_count), inBuffer, byte_pos_in, bit_pos_in);
+			if (clusterOf[context] >= cluster_count) return false;
+		}
+	}
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+	{
+		for (s32 s = 0; s < 256; ++s)
+		{
+			if (readBit(inBuffer, byte_pos_in, bit_pos_in)) lengths[cluster][s] = (u8)readBits(4, inBuffer, byte_pos_in, bit_pos_in);
+			if (lengths[cluster][s] > CONTEXT_MAX_CODE_BITS) return false;
+		}
+	}
+	return true;
+}
+
+// decompress file compressed in order-1 context mode from inBuffer to outBuffer and returns size of decompressed size in bytes
+// returns 0 if the header is not valid
+s64 decompressContext(u8* inBuffer, s64 inBuffer_size, u8* outBuffer, s64 outBuffer_size, filenames files)
+{
+	METRICS_BEGIN(PHASE_TREE_BUILD);
+	s64 byte_pos_in = 0;
+	u8 bit_pos_in = 0;
+	// extract clusters and their code lengths from an encoded stream
+	u32 cluster_count;
+	u8 clusterOf[256] = {};
+	u8 lengths[CONTEXT_MAX_CLUSTERS][256] = {};
+	bool valid = readContextHeader(inBuffer, byte_pos_in, bit_pos_in, cluster_count, clusterOf, lengths);
+	// get how many symbols are in an encoded stream
+	u32 size = valid ? readFourBytes(inBuffer, byte_pos_in, bit_pos_in) : 0;
+	METRICS_END(PHASE_TREE_BUILD);
+	if (!valid || size > outBuffer_size) return 0;
+
+	METRICS_BEGIN(PHASE_TABLE_BUILD);
+	for (u32 cluster = 0; cluster < cluster_count; ++cluster)
+	{
+		buildCanonicalCodes(lengths[cluster], ContextCodes[cluster]);
+		buildContextDecodeTable(ContextCodes[cluster], ContextDecodeTables[cluster]);
+	}
+	const u16* contextTables[256];
+	for (s32 context = 0; context < 256; ++context) contextTables[context] = ContextDecodeTables[clusterOf[context]];
+	decodeContextKernelFn decode = selectDecodeContextKernel();
+	METRICS_END(PHASE_TABLE_BUILD);
+
+	s64 byte_pos_out = 0;
+	// create a thread to print progress bar
+	std::thread stats_thread(printProgressBar, statistics{&byte_pos_in, &byte_pos_out,
+							inBuffer_size, files}, false /* compressing */);
+
+	METRICS_BEGIN(PHASE_CODING);
+	while (byte_pos_out < size)
+	{
+		const s64 block_start = byte_pos_out;
+		const s64 block_end = size - block_start > CODING_BLOCK_SIZE ? block_start + CODING_BLOCK_SIZE : size;
+		METRICS_BLOCK_BEGIN(byte_pos_in * 8 + bit_pos_in);
+
+		decode(inBuffer, inBuffer_size, contextTables, outBuffer, block_end, byte_pos_in, bit_pos_in, byte_pos_out);
+
+		METRICS_BLOCK_END(block_end - block_start, byte_pos_in * 8 + bit_pos_in);
+	}
+	METRICS_END(PHASE_CODING);
+
 	stats_thread.join();
+
+	METRICS_ADD(bytes_in, inBuffer_size);
+	METRICS_ADD(bytes_out, byte_pos_out);
+	METRICS_ADD(symbols, byte_pos_out);
 	return byte_pos_out;
 }
 
 #endif
-
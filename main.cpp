@@ -33,6 +33,8 @@ static void issami_instrukcija(string ProgramName)
 	cout << "  Papildomai galima nurodyti suspaudimo lygį - /full arba /fast:\n";
 	cout << "  /full (numatytasis) suspaudimo lygis suspaudžia failą geriau nei /fast, bet\n";
 	cout << "  spaudimas/išskleidimas vyksta atitinkamai lėčiau\n";
+	cout << "  /full kiekvieną baitą koduoja pagal prieš jį einantį baitą, todėl ypač tinka tekstui\n";
+	cout << "  jei taip failo suspausti geriau nepavyksta, jis suspaudžiamas /fast lygiu\n";
 	cout << "  Išskleidžiant failą nereikia nurodyti failo suspaudimo lygį\n";
 	cout << "  \n";
 	cout << "  Vietoj compress/decompress galima atitinkamai naudoti -/+, pvz:\n";
@@ -87,6 +89,8 @@ void disableConsoleOutput(bool disable = true)
 }
 
 const u8 BOM = 0b01010100;
+// /full lygiu suspausto failo žymė
+const u8 BOM_CONTEXT = BOM + 2;
 
 
 static void xor_buffer(u8* inBuffer, s64 size, std::mt19937_64 & cipher)
@@ -107,6 +111,14 @@ static void xor_buffer(u8* inBuffer, s64 size, std::mt19937_64 & cipher)
 	}
 }
 
+// spausdinti surinktas metrikas JSON formatu, jei kompiliuota su COMPRESSION_METRICS
+static void printMetrics()
+{
+#ifdef COMPRESSION_METRICS
+	writeMetricsJSON(cout);
+#endif
+}
+
 static std::mt19937_64 requestPassword()
 {
 	string password;
@@ -139,131 +151,133 @@ int main(int argCount, char** args)
 		}
 		else naudojimo_instrukcija(ProgramName);
 	}
-	else if (argCount == 4)
+	else if (argCount >= 4 && argCount <= 6)
 	{
 		char* command = args[1];
 		char* inFileName = args[2];
 		char* outFileName = args[3];
 
+		// papildomi nustatymai: suspaudimo lygis ir šifravimas
+		bool full = true;
+		bool encrypt = false;
+		for (int arg = 4; arg < argCount; ++arg)
+		{
+			if (strcmp(args[arg], "/full") == 0) full = true;
+			else if (strcmp(args[arg], "/fast") == 0) full = false;
+			else if (strcmp(args[arg], "/encrypt") == 0) encrypt = true;
+			else
+			{
+				naudojimo_instrukcija(ProgramName);
+				exit(EXIT_FAILURE);
+			}
+		}
+
 
 		filenames files = { inFileName, outFileName };
+		METRICS_BEGIN(PHASE_READ);
 		fileContents inFile = readEntireFileToMemory(inFileName);
+		METRICS_END(PHASE_READ);
 		fileContents outFile;
 		
 		if (strcmp(command, "compress") == 0 || strcmp(command, "-") == 0)
 		{
-			outFile.size = inFile.size * 2;
+			outFile.size = inFile.size * 2 + MAX_HEADER_SIZE;
 			outFile.memory = (u8*)malloc((std::size_t)outFile.size);
 
+			// užšifruoto failo pirmas baitas lieka neužšifruotas, kad būtų galima jį atpažinti
 			s64 byte_pos = 0;
+			if (encrypt) writeByte(BOM + 1, outFile.memory, byte_pos, 0);
+			// /full lygio žymė įrašoma tik jei juo failas suspaudžiamas geriau
+			const s64 mode_pos = byte_pos;
 			writeByte(BOM, outFile.memory, byte_pos, 0);
 			writeFourBytes((u32)inFile.size, outFile.memory, byte_pos, 0);
 
+			std::mt19937_64 cipher;
+			if (encrypt) cipher = requestPassword();
+
 			getTimeElapsed();
-			s64 compressed_size = compress(inFile.memory, inFile.size, outFile.memory + 5, outFile.size - 5, files);
-			s64 outFile_final_size = compressed_size + 5;
+			s64 compressed_size;
+			bool context_mode = false;
+			if (full) compressed_size = compressContext(inFile.memory, inFile.size, outFile.memory + byte_pos, outFile.size - byte_pos, files, context_mode);
+			else	  compressed_size = compress(inFile.memory, inFile.size, outFile.memory + byte_pos, outFile.size - byte_pos, files);
+			if (context_mode) outFile.memory[mode_pos] = BOM_CONTEXT;
+			s64 outFile_final_size = compressed_size + byte_pos;
+
+			if (encrypt)
+			{
+				METRICS_BEGIN(PHASE_ENCRYPT);
+				xor_buffer(outFile.memory + 1, outFile_final_size - 1, cipher);
+				METRICS_END(PHASE_ENCRYPT);
+			}
+
+			METRICS_BEGIN(PHASE_WRITE);
 			std::ofstream file(outFileName, std::fstream::binary | std::fstream::out);
 			file.write((char*)outFile.memory, outFile_final_size);
 			file.close();
+			METRICS_END(PHASE_WRITE);
 
 			auto end_time = getTimeElapsed();
 			// spausdinti kiek laiko praejo
 			cout << "Užtruko " << std::setprecision(2) << end_time / 1000.0f << " sekundes" << endl;
+			printMetrics();
 		}
 		else if (strcmp(command, "decompress") == 0 || strcmp(command, "+") == 0)
 		{
+			if (encrypt)
+			{
+				cout << "Ar norėjot suspausti " << inFileName << " failą ? " << " su /encrypt funkcija failo išskleisti negalima";
+				exit(EXIT_FAILURE);
+			}
+
 			s64 byte_pos = 0;
 			u8 first_byte = readByte(inFile.memory, byte_pos, 0);
-			if (first_byte != BOM && first_byte != BOM + 1)
+			if (first_byte != BOM && first_byte != BOM + 1 && first_byte != BOM_CONTEXT)
 			{
 				cout << "Duotas failas " << inFileName << " nebuvo suspaustas su šia programa\nNeįmanoma jo išskleisti";
 				exit(EXIT_FAILURE);
 			}
 
-			bool encrypted = false;
+			u8 mode = first_byte;
 			if (first_byte == BOM + 1)
 			{
 
 				std::mt19937_64 cipher = requestPassword();
 
+				METRICS_BEGIN(PHASE_ENCRYPT);
 				xor_buffer(inFile.memory + 1, inFile.size - 1, cipher);
+				METRICS_END(PHASE_ENCRYPT);
 
-				u8 second_byte = readByte(inFile.memory, byte_pos, 0);
-				if (second_byte != BOM)
+				mode = readByte(inFile.memory, byte_pos, 0);
+				if (mode != BOM && mode != BOM_CONTEXT)
 				{
 					cout << "Neteisingas slaptažodis";
 					exit(EXIT_FAILURE);
 				}
-				encrypted = true;
 			}
 
 			outFile.size = readFourBytes(inFile.memory, byte_pos, 0);
 			outFile.memory = (u8*)malloc((std::size_t)outFile.size);
 
 			getTimeElapsed();
-			s64 decompressed_size = decompress(inFile.memory +(encrypted ? 6: 5), inFile.size - (encrypted ? 6 : 5), outFile.memory, outFile.size, files);
+			s64 decompressed_size;
+			if (mode == BOM_CONTEXT) decompressed_size = decompressContext(inFile.memory + byte_pos, inFile.size - byte_pos, outFile.memory, outFile.size, files);
+			else					 decompressed_size = decompress(inFile.memory + byte_pos, inFile.size - byte_pos, outFile.memory, outFile.size, files);
+			if (decompressed_size != outFile.size)
+			{
+				cout << "Duotas failas " << inFileName << " yra sugadintas\nNeįmanoma jo išskleisti";
+				exit(EXIT_FAILURE);
+			}
+
+			METRICS_BEGIN(PHASE_WRITE);
 			std::ofstream file(outFileName, std::fstream::binary | std::fstream::out);
 			file.write((char*)outFile.memory, decompressed_size);
 			file.close();
+			METRICS_END(PHASE_WRITE);
 
 			auto end_time = getTimeElapsed();
 			// spausdinti kiek laiko praejo
 			cout << "Užtruko " << std::setprecision(2) << end_time / 1000.0f << " sekundes" << endl;
-		}
-		else
-		{
-			naudojimo_instrukcija(ProgramName);
-			exit(EXIT_FAILURE);
-		}
-	}
-	else if (argCount == 5)
-	{
-		char* command = args[1];
-		char* encrypt = args[4];
-		char* inFileName = args[2];
-		char* outFileName = args[3];
-
-		if (strcmp(encrypt, "/encrypt") != 0)
-		{
-			naudojimo_instrukcija(ProgramName);
-			exit(EXIT_FAILURE);
-		}
-	
-
-		filenames files = { inFileName, outFileName };
-		fileContents inFile = readEntireFileToMemory(inFileName);
-		fileContents outFile;
-
-		if (strcmp(command, "compress") == 0 || strcmp(command, "-") == 0)
-		{
-			outFile.size = inFile.size * 2;
-			outFile.memory = (u8*)memset(malloc((std::size_t)outFile.size), 0, (std::size_t)outFile.size);
-
-			s64 byte_pos = 0;
-			writeByte(BOM + 1, outFile.memory, byte_pos, 0);
-			writeByte(BOM, outFile.memory, byte_pos, 0);
-			writeFourBytes((u32)inFile.size, outFile.memory, byte_pos, 0);
-
-			std::mt19937_64 cipher = requestPassword();
-
-			getTimeElapsed();
-			s64 compressed_size = compress(inFile.memory, inFile.size, outFile.memory + 6, outFile.size - 6, files);
-			s64 outFile_final_size = compressed_size + 6;
-
-			xor_buffer(outFile.memory + 1, outFile_final_size - 1, cipher);
-
-			std::ofstream file(outFileName, std::fstream::binary | std::fstream::out);
-			file.write((char*)outFile.memory, outFile_final_size);
-			file.close();
-
-			auto end_time = getTimeElapsed();
-			// spausdinti kiek laiko praejo			
-			cout << "Užtruko " << std::setprecision(2) << end_time / 1000.0f << " sekundes" << endl;
-		}
-		else if (strcmp(command, "decompress") == 0 || strcmp(command, "+") == 0)
-		{
-			cout << "Ar norėjot suspausti " << inFileName << " failą ? " << " su /encrypt funkcija failo išskleisti negalima";
-			exit(EXIT_FAILURE);
+			printMetrics();
 		}
 		else
 		{